@@ -5,6 +5,11 @@
 #include <mutex>
 #include <vector>
 #include <iostream>
+#include <unordered_map>
+#include <algorithm>
+#include <map>
+#include <cstring>
+#include <cstdlib>
 
 #ifdef _WIN32
 #include <intrin.h>
@@ -12,9 +17,21 @@
 #else
 #include <x86intrin.h>
 #include <dlfcn.h>
+#include <cxxabi.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #endif
 #pragma intrinsic(__rdtsc)
 
+#if defined(MY_PROFILE_INSTRUMENT_FUNCTIONS) && defined(_WIN32)
+#error "MY_PROFILE_INSTRUMENT_FUNCTIONS needs -finstrument-functions and dladdr (GCC/Clang on Linux)"
+#endif
+
 struct dump_items
 {
     std::string name;      // The name of the event, as displayed in Trace Viewer
@@ -26,13 +43,108 @@ struct dump_items
     uint64_t ts2 = 0;      // Duration = ts2 - ts1.
     std::string tts;       // Optional. The thread clock timestamp of the event
     std::vector<std::pair<std::string, std::string>> vecArgs;
+    void *func = nullptr;  // Instrumented function, its name is resolved when the trace is saved
+    bool has_sched = false; // MY_PROFILE_SCHED=1: scheduler counter deltas between ts1 and ts2
+    sched_counters sched;
+};
+
+// Formatted once per thread. A plain char array, so it is still valid while other thread_local
+// destructors (which may be instrumented, see __cyg_profile_func_exit) run at thread exit.
+static inline const char *get_thread_id()
+{
+    static thread_local char tid[32] = {0};
+    if (tid[0] == 0)
+    {
+        std::stringstream ss;
+        ss << std::this_thread::get_id();
+        snprintf(tid, sizeof(tid), "%s", ss.str().c_str());
+    }
+    return tid;
+}
+
+#ifdef __linux__
+// CPU migrations of the calling thread from a perf software event, opened on first use per thread.
+// Migrations are counted in kernel context, so the event needs exclude_kernel=0 and thus
+// perf_event_paranoid <= 1 (or CAP_PERFMON). With exclude_kernel=1 it opens at paranoid 2 but always
+// reads 0, so there is no weaker config to retry; callers fall back to an approximation instead.
+struct migration_counter
+{
+    int fd = -2; // -2: not opened yet, -1: perf_event_open is not permitted or already closed
+    ~migration_counter()
+    {
+        // A MyProfile scope in a later thread_local destructor must not read the closed (maybe reused) fd
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+
+    int64_t read_count()
+    {
+        if (fd == -2)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_CPU_MIGRATIONS;
+            fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fd < 0)
+                fd = -1;
+        }
+        uint64_t count = 0;
+        if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+            return -1;
+        return static_cast<int64_t>(count);
+    }
 };
+static thread_local migration_counter t_migrations;
+#endif
+
+static void read_sched_counters(sched_counters &c)
+{
+#ifdef __linux__
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    c.vol_cs = usage.ru_nvcsw;
+    c.invol_cs = usage.ru_nivcsw;
+    c.minflt = usage.ru_minflt;
+    c.migrations = t_migrations.read_count();
+    c.cpu = sched_getcpu();
+#endif
+}
 
-static inline std::string get_thread_id()
+static sched_counters sched_delta(const sched_counters &begin, const sched_counters &end)
 {
-    std::stringstream ss;
-    ss << std::this_thread::get_id();
-    return ss.str();
+    sched_counters d;
+    d.vol_cs = end.vol_cs - begin.vol_cs;
+    d.invol_cs = end.invol_cs - begin.invol_cs;
+    d.minflt = end.minflt - begin.minflt;
+    // Without the perf event only a different CPU at exit is visible, at least one migration
+    if (begin.migrations >= 0 && end.migrations >= 0)
+        d.migrations = end.migrations - begin.migrations;
+    else
+    {
+        d.migrations = begin.cpu != end.cpu ? 1 : 0;
+        d.migrations_approx = true;
+    }
+    d.cpu = end.cpu;
+    return d;
+}
+
+// Why a scope may have been slow: "preempted", "migrated", "blocked", "page_faults" joined by '+', or "clean"
+static std::string sched_class(const sched_counters &d)
+{
+    std::string cls;
+    auto append = [&](bool cond, const char *name)
+    {
+        if (cond)
+            cls += (cls.empty() ? "" : "+") + std::string(name);
+    };
+    append(d.invol_cs > 0, "preempted");
+    append(d.migrations > 0, "migrated");
+    append(d.vol_cs > 0, "blocked");
+    append(d.minflt > 0, "page_faults");
+    return cls.empty() ? "clean" : cls;
 }
 
 static uint64_t rdtsc_calibrate(int seconds = 1)
@@ -60,6 +172,81 @@ inline std::string location(void)
     return fn;
 }
 
+#ifdef MY_PROFILE_INSTRUMENT_FUNCTIONS
+// Call stack of the instrumented functions per thread. Only trivially destructible thread_locals are
+// used here, the hooks still run while a thread is torn down.
+struct func_frame
+{
+    void *func;
+    uint64_t ts1;
+};
+static constexpr int max_func_depth = 256;
+static thread_local func_frame t_func_stack[max_func_depth];
+static thread_local int t_func_depth = 0;
+// Set while an event is recorded. The profiler may call instrumented code (inline std functions are merged
+// with the instrumented copies by the linker), such nested calls are not recorded.
+static thread_local bool t_func_recording = false;
+// Per thread copy of the include/exclude decisions, so the hook doesn't touch the shared name cache after
+// the first exit of a function on this thread. Direct mapped, a collision just looks the function up again.
+struct func_keep_slot
+{
+    void *func;
+    bool keep;
+};
+static constexpr size_t func_keep_slots = 1024;
+static thread_local func_keep_slot t_func_keep[func_keep_slots];
+
+// Set t_func_recording for the whole profiler entry point, not only around add(): building dump_items,
+// lock bookkeeping and saving the trace all run instrumented inline std code.
+struct func_recording_guard
+{
+    bool recording;
+    func_recording_guard() : recording(t_func_recording) { t_func_recording = true; }
+    ~func_recording_guard() { t_func_recording = recording; }
+};
+#else
+struct func_recording_guard
+{
+    func_recording_guard() {}
+};
+#endif
+
+// Longest waits for one lock
+struct lock_waiter
+{
+    std::string tid;
+    uint64_t ts = 0;   // Start of the wait
+    uint64_t wait = 0; // [tsc ticks]
+};
+
+struct LockStats
+{
+    static constexpr size_t max_waiters = 5;
+    std::string name;
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0};
+    std::atomic<uint64_t> wait_ticks{0};
+    std::atomic<uint64_t> hold_ticks{0};
+    std::atomic<uint64_t> max_hold_ticks{0};
+    // Only taken on the contended path
+    std::mutex waiters_mutex;
+    std::vector<lock_waiter> worst_waiters; // Longest wait first
+};
+
+// Stats per lock site name, shared by all mutexes of that name. Never freed, profiled mutexes with static
+// storage may outlive g_profileManage.
+static std::mutex &lock_registry_mutex()
+{
+    static std::mutex *m = new std::mutex;
+    return *m;
+}
+
+static std::map<std::string, std::shared_ptr<LockStats>> &lock_registry()
+{
+    static auto *locks = new std::map<std::string, std::shared_ptr<LockStats>>;
+    return *locks;
+}
+
 class ProfilerManager
 {
 protected:
@@ -67,10 +254,26 @@ protected:
     std::atomic<uint64_t> tsc_ticks_per_second{0};
     std::atomic<uint64_t> tsc_ticks_base{0};
     std::mutex _mutex;
+    bool _sched_enabled = false; // MY_PROFILE_SCHED=1, see Example 5 in dump_profile.hpp
+#ifdef MY_PROFILE_INSTRUMENT_FUNCTIONS
+    // -finstrument-functions filters, see Example 4 in dump_profile.hpp
+    std::vector<std::string> _func_include;
+    std::vector<std::string> _func_exclude;
+    uint64_t _func_min_ticks = 0;
+    // Function address -> demangled name, empty if the function is filtered out. Only looked up on a
+    // t_func_keep miss and when the trace is saved, a plain mutex is enough.
+    std::unordered_map<void *, std::string> _func_names;
+    std::mutex _func_names_mutex;
+#endif
 
 public:
+    // Function entry/exit hooks and profiled mutexes with static storage may run before this object is
+    // constructed or after it is destroyed, they must not add events unless it is set.
+    std::atomic<bool> ready{false};
+
     ProfilerManager()
     {
+        func_recording_guard guard;
         if (tsc_ticks_per_second == 0)
         {
             uint64_t expected = 0;
@@ -80,23 +283,205 @@ public:
             tsc_ticks_base.compare_exchange_strong(expected, __rdtsc());
             std::cout << "=== ProfilerManager: tsc_ticks_base = " << tsc_ticks_base << std::endl;
         }
+        const char *sched = std::getenv("MY_PROFILE_SCHED");
+        _sched_enabled = sched && std::string(sched) != "0";
+#ifdef MY_PROFILE_INSTRUMENT_FUNCTIONS
+        _func_include = split_env("MY_PROFILE_FUNC_INCLUDE");
+        _func_exclude = split_env("MY_PROFILE_FUNC_EXCLUDE");
+        const char *min_us = std::getenv("MY_PROFILE_FUNC_MIN_US");
+        if (min_us)
+            _func_min_ticks = static_cast<uint64_t>(std::atof(min_us) * tsc_ticks_per_second / 1000000.0);
+#endif
+        ready = true;
     }
 
     ProfilerManager(ProfilerManager &other) = delete;
     void operator=(const ProfilerManager &) = delete;
     ~ProfilerManager()
     {
+        func_recording_guard guard;
+        ready = false;
         // Save tracing log to json file.
         save_to_json();
+        print_lock_stats();
+        print_sched_summary();
     }
 
     void add(const dump_items &val)
     {
+        // Instrumented code called from here would record into _vecItems again while _mutex is held
+        func_recording_guard guard;
         std::lock_guard<std::mutex> lk(_mutex);
         _vecItems.emplace_back(val);
     }
 
+    bool sched_enabled() const
+    {
+        return _sched_enabled;
+    }
+
+#ifdef MY_PROFILE_INSTRUMENT_FUNCTIONS
+    uint64_t func_min_ticks() const
+    {
+        return _func_min_ticks;
+    }
+
+    // Include/exclude filters. Resolved once per function on its first recorded exit, after that the
+    // decision comes from the per thread t_func_keep without any lock.
+    bool func_keep(void *func)
+    {
+        if (_func_include.empty() && _func_exclude.empty())
+            return true;
+        auto &slot = t_func_keep[(reinterpret_cast<uintptr_t>(func) >> 4) % func_keep_slots];
+        if (slot.func != func)
+        {
+            slot.keep = !func_name(func).empty();
+            slot.func = func;
+        }
+        return slot.keep;
+    }
+#endif
+
 private:
+#ifdef MY_PROFILE_INSTRUMENT_FUNCTIONS
+    // Comma separated list from an environment variable
+    static std::vector<std::string> split_env(const char *name)
+    {
+        std::vector<std::string> items;
+        const char *val = std::getenv(name);
+        std::stringstream ss(val ? val : "");
+        std::string item;
+        while (std::getline(ss, item, ','))
+        {
+            if (!item.empty())
+                items.push_back(item);
+        }
+        return items;
+    }
+
+    // Resolve the name of an instrumented function once, empty if the include/exclude filters drop it.
+    // Functions dladdr can't name (e.g. not exported, see -rdynamic) are named by their address.
+    const std::string &func_name(void *func)
+    {
+        {
+            std::lock_guard<std::mutex> lk(_func_names_mutex);
+            auto it = _func_names.find(func);
+            if (it != _func_names.end())
+                return it->second;
+        }
+
+        std::string name;
+        Dl_info info;
+        if (dladdr(func, &info) && info.dli_sname)
+        {
+            int status = 0;
+            char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            name = status == 0 && demangled ? demangled : info.dli_sname;
+            std::free(demangled);
+        }
+        else
+        {
+            char addr[32];
+            snprintf(addr, sizeof(addr), "%p", func);
+            name = addr;
+        }
+
+        bool keep = _func_include.empty();
+        for (auto &inc : _func_include)
+            keep = keep || name.find(inc) != std::string::npos;
+        for (auto &exc : _func_exclude)
+            keep = keep && name.find(exc) == std::string::npos;
+        // References to unordered_map elements stay valid on insert
+        std::lock_guard<std::mutex> lk(_func_names_mutex);
+        return _func_names.emplace(func, keep ? name : std::string()).first->second;
+    }
+#endif
+
+    double tsc_to_usec(uint64_t tsc_ticks)
+    {
+        return tsc_ticks * 1000000.0 / tsc_ticks_per_second;
+    }
+
+    // Per site totals of the scheduler counters, and the outliers (> 2x median duration) by sched_class.
+    void print_sched_summary()
+    {
+        if (!_sched_enabled)
+            return;
+        std::map<std::string, std::vector<const dump_items *>> sites;
+        for (auto &itm : _vecItems)
+        {
+            if (itm.has_sched)
+                sites[itm.name].push_back(&itm);
+        }
+
+        printf("=== Scheduler attribution per site (outlier = duration > 2x median):\n");
+        for (auto &site : sites)
+        {
+            auto &items = site.second;
+            std::vector<uint64_t> durs;
+            sched_counters total;
+            total.migrations = 0;
+            for (auto itm : items)
+            {
+                total.migrations_approx |= itm->sched.migrations_approx;
+                durs.push_back(itm->ts2 - itm->ts1);
+                total.vol_cs += itm->sched.vol_cs;
+                total.invol_cs += itm->sched.invol_cs;
+                total.minflt += itm->sched.minflt;
+                total.migrations += itm->sched.migrations;
+            }
+            std::nth_element(durs.begin(), durs.begin() + durs.size() / 2, durs.end());
+            uint64_t median = durs[durs.size() / 2];
+
+            size_t outliers = 0, preempted = 0, migrated = 0, blocked = 0, page_faults = 0, unexplained = 0;
+            for (auto itm : items)
+            {
+                if (itm->ts2 - itm->ts1 <= 2 * median)
+                    continue;
+                auto &d = itm->sched;
+                outliers++;
+                preempted += d.invol_cs > 0;
+                migrated += d.migrations > 0;
+                blocked += d.vol_cs > 0;
+                page_faults += d.minflt > 0;
+                unexplained += d.invol_cs <= 0 && d.migrations <= 0 && d.vol_cs <= 0 && d.minflt <= 0;
+            }
+            printf("    %s: count = %zu, median = %.3f us, vol_cs = %lld, invol_cs = %lld, %s = %lld, minflt = %lld, "
+                   "outliers = %zu (preempted %zu, migrated %zu, blocked %zu, page_faults %zu, unexplained %zu)\n",
+                   site.first.c_str(), items.size(), tsc_to_usec(median), static_cast<long long>(total.vol_cs), static_cast<long long>(total.invol_cs),
+                   total.migrations_approx ? "migrations(approx)" : "migrations", static_cast<long long>(total.migrations), static_cast<long long>(total.minflt), outliers, preempted, migrated, blocked, page_faults, unexplained);
+        }
+    }
+
+    void print_lock_stats()
+    {
+        std::lock_guard<std::mutex> lk(lock_registry_mutex());
+        std::vector<std::shared_ptr<LockStats>> locks;
+        for (auto &l : lock_registry())
+            locks.push_back(l.second);
+        if (locks.empty())
+            return;
+        std::sort(locks.begin(), locks.end(), [](const std::shared_ptr<LockStats> &a, const std::shared_ptr<LockStats> &b)
+                  { return a->wait_ticks > b->wait_ticks; });
+
+        printf("=== Lock contention (sorted by total wait):\n");
+        for (auto &l : locks)
+        {
+            uint64_t acquisitions = l->acquisitions;
+            uint64_t contended = l->contended;
+            printf("    %s: acquisitions = %llu, contended = %llu (%.2f%%), total wait = %.3f ms, avg contended wait = %.3f us, "
+                   "total hold = %.3f ms, max hold = %.3f us\n",
+                   l->name.c_str(), static_cast<unsigned long long>(acquisitions), static_cast<unsigned long long>(contended),
+                   acquisitions ? contended * 100.0 / acquisitions : 0.0, tsc_to_usec(l->wait_ticks) / 1000,
+                   contended ? tsc_to_usec(l->wait_ticks) / contended : 0.0, tsc_to_usec(l->hold_ticks) / 1000, tsc_to_usec(l->max_hold_ticks));
+            std::lock_guard<std::mutex> wlk(l->waiters_mutex);
+            for (auto &w : l->worst_waiters)
+            {
+                printf("        worst wait: tid = %s, ts = %s us, wait = %.3f us\n", w.tid.c_str(), tsc_to_nsec(w.ts).c_str(), tsc_to_usec(w.wait));
+            }
+        }
+    }
+
     std::string tsc_to_nsec(uint64_t tsc_ticks)
     {
         double val = (tsc_ticks - tsc_ticks_base) * 1000000.0 / tsc_ticks_per_second;
@@ -128,12 +513,23 @@ private:
         // Headers
         fprintf(pf, "{\n\"schemaVersion\": 1,\n\"traceEvents\":[\n");
 
+        bool first = true;
         for (size_t i = 0; i < _vecItems.size(); i++)
         {
             auto &itm = _vecItems[i];
+            const std::string *name = &itm.name;
+#ifdef MY_PROFILE_INSTRUMENT_FUNCTIONS
+            if (itm.func)
+            {
+                name = &func_name(itm.func);
+                if (name->empty())
+                    continue;
+            }
+#endif
             // Write 1 event
-            fprintf(pf, "{");
-            fprintf(pf, "\"name\":\"%s\",", itm.name.c_str());
+            fprintf(pf, "%s{", first ? "" : ",\n");
+            first = false;
+            fprintf(pf, "\"name\":\"%s\",", name->c_str());
             fprintf(pf, "\"cat\":\"%s\",", itm.cat.c_str());
             fprintf(pf, "\"ph\":\"%s\",", itm.ph.c_str());
             fprintf(pf, "\"pid\":\"%s\",", itm.pid.c_str());
@@ -145,30 +541,325 @@ private:
             {
                 fprintf(pf, "\"%s\":\"%s\"%s", itm.vecArgs[j].first.c_str(), itm.vecArgs[j].second.c_str(), j + 1 == itm.vecArgs.size() ? "" : ",");
             }
-            fprintf(pf, "}}%s\n", i == _vecItems.size() - 1 ? "" : ",");
+            fprintf(pf, "}}");
         }
 
-        fprintf(pf, "]\n}\n");
+        fprintf(pf, "\n]\n}\n");
         fclose(pf);
         printf("Profiler log is saved to: %s\n", json_fn.c_str());
     }
 };
 static ProfilerManager g_profileManage;
+// No defaulted args: the caller would build and destroy an empty vector, instrumented, on every scope.
+MyProfile::MyProfile(const std::string &name)
+{
+    func_recording_guard guard;
+    _name = name;
+    begin();
+}
+
 MyProfile::MyProfile(const std::string &name, const std::vector<std::pair<std::string, std::string>> &args)
 {
+    func_recording_guard guard;
     _name = name;
     _args = args;
+    begin();
+}
+
+void MyProfile::begin()
+{
+    // Read the counters outside of [ts1, ts2], their cost is not part of the scope
+    _sched = g_profileManage.sched_enabled();
+    if (_sched)
+        read_sched_counters(_sched_begin);
     _ts1 = __rdtsc();
 }
 
 MyProfile::~MyProfile()
 {
+    uint64_t ts2 = __rdtsc();
+#ifdef MY_PROFILE_INSTRUMENT_FUNCTIONS
+    // Not a func_recording_guard: _name and _args are destroyed after this body, _recording_restore after them
+    _recording_restore.recording = t_func_recording;
+    t_func_recording = true;
+#endif
     dump_items itm;
-    itm.ts2 = __rdtsc();
+    itm.ts2 = ts2;
     itm.ts1 = _ts1;
     itm.name = _name;
     itm.tid = get_thread_id();
     itm.cat = "PERF";
     itm.vecArgs = _args;
+    if (_sched)
+    {
+        sched_counters end;
+        read_sched_counters(end);
+        itm.has_sched = true;
+        itm.sched = sched_delta(_sched_begin, end);
+        itm.vecArgs.emplace_back("vol_cs", std::to_string(itm.sched.vol_cs));
+        itm.vecArgs.emplace_back("invol_cs", std::to_string(itm.sched.invol_cs));
+        itm.vecArgs.emplace_back(itm.sched.migrations_approx ? "cpu_migrations_approx" : "cpu_migrations", std::to_string(itm.sched.migrations));
+        itm.vecArgs.emplace_back("minflt", std::to_string(itm.sched.minflt));
+        itm.vecArgs.emplace_back("sched", sched_class(itm.sched));
+    }
     g_profileManage.add(itm);
-}
\ No newline at end of file
+}
+
+MyProfile::recording_restore::~recording_restore()
+{
+#ifdef MY_PROFILE_INSTRUMENT_FUNCTIONS
+    t_func_recording = recording;
+#endif
+}
+
+static std::shared_ptr<LockStats> register_lock(const std::string &name)
+{
+    func_recording_guard guard;
+    std::lock_guard<std::mutex> lk(lock_registry_mutex());
+    auto &stats = lock_registry()[name];
+    if (!stats)
+    {
+        stats = std::make_shared<LockStats>();
+        stats->name = name;
+    }
+    return stats;
+}
+
+// Account one acquire/release of a lock, ts_wait is 0 if the lock was acquired without waiting.
+static void record_lock(LockStats &stats, uint64_t ts_wait, uint64_t ts_acquired, uint64_t ts_released, bool shared)
+{
+    func_recording_guard guard;
+    uint64_t hold = ts_released - ts_acquired;
+    stats.acquisitions.fetch_add(1, std::memory_order_relaxed);
+    stats.hold_ticks.fetch_add(hold, std::memory_order_relaxed);
+    uint64_t max_hold = stats.max_hold_ticks.load(std::memory_order_relaxed);
+    while (hold > max_hold && !stats.max_hold_ticks.compare_exchange_weak(max_hold, hold, std::memory_order_relaxed))
+        ;
+    if (ts_wait == 0)
+        return;
+
+    uint64_t wait = ts_acquired - ts_wait;
+    stats.contended.fetch_add(1, std::memory_order_relaxed);
+    stats.wait_ticks.fetch_add(wait, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lk(stats.waiters_mutex);
+        auto &worst = stats.worst_waiters;
+        if (worst.size() < LockStats::max_waiters || wait > worst.back().wait)
+        {
+            auto pos = std::find_if(worst.begin(), worst.end(), [&](const lock_waiter &w)
+                                    { return w.wait < wait; });
+            worst.insert(pos, lock_waiter{get_thread_id(), ts_wait, wait});
+            if (worst.size() > LockStats::max_waiters)
+                worst.pop_back();
+        }
+    }
+
+    // The aggregates above live in the leaked lock registry, the trace buffer only while g_profileManage does
+    if (!g_profileManage.ready)
+        return;
+    dump_items itm;
+    itm.name = stats.name + ":wait";
+    itm.cat = "LOCK";
+    itm.tid = get_thread_id();
+    itm.ts1 = ts_wait;
+    itm.ts2 = ts_acquired;
+    itm.vecArgs = {{"mode", shared ? "shared" : "exclusive"}};
+    g_profileManage.add(itm);
+    itm.name = stats.name + ":hold";
+    itm.ts1 = ts_acquired;
+    itm.ts2 = ts_released;
+    g_profileManage.add(itm);
+}
+
+// Exclusive lock bookkeeping of ProfiledMutex and ProfiledSharedMutex, ts_wait/ts_acquired are
+// members of the profiled mutex and only written while it is held.
+template <typename Mutex>
+static void profiled_lock(Mutex &m, uint64_t &ts_wait, uint64_t &ts_acquired)
+{
+    // Fast path: one timestamp if nobody holds the lock
+    if (m.try_lock())
+    {
+        ts_wait = 0;
+        ts_acquired = __rdtsc();
+        return;
+    }
+    uint64_t ts = __rdtsc();
+    m.lock();
+    ts_wait = ts;
+    ts_acquired = __rdtsc();
+}
+
+template <typename Mutex>
+static bool profiled_try_lock(Mutex &m, uint64_t &ts_wait, uint64_t &ts_acquired)
+{
+    if (!m.try_lock())
+        return false;
+    ts_wait = 0;
+    ts_acquired = __rdtsc();
+    return true;
+}
+
+template <typename Mutex>
+static void profiled_unlock(Mutex &m, const uint64_t &ts_wait, const uint64_t &ts_acquired, LockStats &stats)
+{
+    uint64_t ts_released = __rdtsc();
+    // Copy before unlock, the next owner overwrites them
+    uint64_t wait = ts_wait;
+    uint64_t acquired = ts_acquired;
+    m.unlock();
+    record_lock(stats, wait, acquired, ts_released, false);
+}
+
+ProfiledMutex::ProfiledMutex(const std::string &name) : _stats(register_lock(name))
+{
+}
+
+ProfiledMutex::~ProfiledMutex()
+{
+    func_recording_guard guard;
+    _stats.reset();
+}
+
+void ProfiledMutex::lock()
+{
+    func_recording_guard guard;
+    profiled_lock(_mutex, _ts_wait, _ts_acquired);
+}
+
+bool ProfiledMutex::try_lock()
+{
+    func_recording_guard guard;
+    return profiled_try_lock(_mutex, _ts_wait, _ts_acquired);
+}
+
+void ProfiledMutex::unlock()
+{
+    func_recording_guard guard;
+    profiled_unlock(_mutex, _ts_wait, _ts_acquired, *_stats);
+}
+
+#ifdef MY_PROFILE_HAS_SHARED_MUTEX
+// Shared owners can't keep their timestamps in the mutex, every thread keeps its own shared holds.
+struct shared_hold
+{
+    const ProfiledSharedMutex *mutex;
+    uint64_t ts_wait;
+    uint64_t ts_acquired;
+};
+static thread_local std::vector<shared_hold> t_shared_holds;
+
+ProfiledSharedMutex::ProfiledSharedMutex(const std::string &name) : _stats(register_lock(name))
+{
+}
+
+ProfiledSharedMutex::~ProfiledSharedMutex()
+{
+    func_recording_guard guard;
+    _stats.reset();
+}
+
+void ProfiledSharedMutex::lock()
+{
+    func_recording_guard guard;
+    profiled_lock(_mutex, _ts_wait, _ts_acquired);
+}
+
+bool ProfiledSharedMutex::try_lock()
+{
+    func_recording_guard guard;
+    return profiled_try_lock(_mutex, _ts_wait, _ts_acquired);
+}
+
+void ProfiledSharedMutex::unlock()
+{
+    func_recording_guard guard;
+    profiled_unlock(_mutex, _ts_wait, _ts_acquired, *_stats);
+}
+
+void ProfiledSharedMutex::lock_shared()
+{
+    func_recording_guard guard;
+    if (_mutex.try_lock_shared())
+    {
+        t_shared_holds.push_back({this, 0, __rdtsc()});
+        return;
+    }
+    uint64_t ts_wait = __rdtsc();
+    _mutex.lock_shared();
+    t_shared_holds.push_back({this, ts_wait, __rdtsc()});
+}
+
+bool ProfiledSharedMutex::try_lock_shared()
+{
+    func_recording_guard guard;
+    if (!_mutex.try_lock_shared())
+        return false;
+    t_shared_holds.push_back({this, 0, __rdtsc()});
+    return true;
+}
+
+void ProfiledSharedMutex::unlock_shared()
+{
+    func_recording_guard guard;
+    uint64_t ts_released = __rdtsc();
+    // Copy before unlock, an exclusive owner may destroy *this right after it. The stats stay alive in the
+    // lock registry, `this` is only compared below.
+    LockStats *stats = _stats.get();
+    _mutex.unlock_shared();
+    // Usually the most recent hold, shared locks are mostly released in reverse order
+    for (size_t i = t_shared_holds.size(); i-- > 0;)
+    {
+        if (t_shared_holds[i].mutex == this)
+        {
+            shared_hold hold = t_shared_holds[i];
+            t_shared_holds.erase(t_shared_holds.begin() + i);
+            record_lock(*stats, hold.ts_wait, hold.ts_acquired, ts_released, true);
+            return;
+        }
+    }
+}
+#endif
+
+#ifdef MY_PROFILE_INSTRUMENT_FUNCTIONS
+extern "C" __attribute__((no_instrument_function)) void __cyg_profile_func_enter(void *func, void *)
+{
+    if (t_func_recording)
+        return;
+    if (t_func_depth < max_func_depth)
+        t_func_stack[t_func_depth] = {func, __rdtsc()};
+    t_func_depth++;
+}
+
+extern "C" __attribute__((no_instrument_function)) void __cyg_profile_func_exit(void *func, void *)
+{
+    uint64_t ts2 = __rdtsc();
+    if (t_func_recording || t_func_depth == 0)
+        return;
+    if (t_func_depth > max_func_depth)
+    {
+        t_func_depth--;
+        return;
+    }
+    // longjmp skips the exits of the frames it unwinds, resync on the frame this exit belongs to
+    int depth = t_func_depth - 1;
+    while (depth >= 0 && t_func_stack[depth].func != func)
+        depth--;
+    if (depth < 0)
+        return;
+    t_func_depth = depth;
+
+    func_recording_guard guard;
+    auto &frame = t_func_stack[depth];
+    // Cheap drop of tiny functions before anything is allocated, then the cached per function filter
+    if (g_profileManage.ready && ts2 - frame.ts1 >= g_profileManage.func_min_ticks() && g_profileManage.func_keep(frame.func))
+    {
+        dump_items itm;
+        itm.ts1 = frame.ts1;
+        itm.ts2 = ts2;
+        itm.func = frame.func;
+        itm.tid = get_thread_id();
+        itm.cat = "FUNC";
+        g_profileManage.add(itm);
+    }
+}
+#endif
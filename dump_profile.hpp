@@ -1,18 +1,50 @@
 #pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+// std::shared_mutex needs C++17, ProfiledSharedMutex is left out for older standards
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define MY_PROFILE_HAS_SHARED_MUTEX 1
+#include <shared_mutex>
+#endif
+
+// Per thread scheduler counters, see Example 5
+struct sched_counters
+{
+    int64_t vol_cs = 0;     // Voluntary context switches (blocked, sleep, IO, lock wait)
+    int64_t invol_cs = 0;   // Involuntary context switches (preempted)
+    int64_t minflt = 0;     // Minor page faults
+    int64_t migrations = 0; // CPU migrations, -1 if the perf event is not available
+    int cpu = -1;           // CPU the thread ran on when the counters were read
+    bool migrations_approx = false; // migrations is only a CPU change between two reads, a lower bound
+};
+
 class MyProfile
 {
 public:
     MyProfile() = delete;
-    MyProfile(const std::string &name, const std::vector<std::pair<std::string, std::string>> &args = std::vector<std::pair<std::string, std::string>>());
+    MyProfile(const std::string &name);
+    MyProfile(const std::string &name, const std::vector<std::pair<std::string, std::string>> &args);
     ~MyProfile();
 
 private:
+    void begin();
+
+    // Declared first so it is destroyed last: with MY_PROFILE_INSTRUMENT_FUNCTIONS the destructor keeps
+    // the profiler's own member destruction out of the trace until here, see dump_profile.cpp.
+    struct recording_restore
+    {
+        bool recording = false;
+        ~recording_restore();
+    } _recording_restore;
     std::string _name;
     uint64_t _ts1;
     std::vector<std::pair<std::string, std::string>> _args;
+    bool _sched = false;
+    sched_counters _sched_begin;
 };
 
 #define MY_PROFILE(NAME) MyProfile(NAME + std::string(":") + std::to_string(__LINE__))
@@ -53,4 +85,103 @@ Or
     MY_PROFILE_VAR_ARGS(p2, "fun_name", {{"arg1", "sleep 30 ms"}});
     func()
 }
-******************************************************/
\ No newline at end of file
+******************************************************/
+
+// Lock contention profiling: drop-in replacements of std::mutex / std::shared_mutex which record per lock
+// site (mutexes with the same name share their stats) the time spent waiting for the lock and the time it
+// is held. An uncontended acquire reads the TSC once, a contended one twice. Every release reads it again
+// and updates the site's shared counters (acquisitions, hold time, max hold: 3+ atomic RMWs on one cache
+// line). Contended acquisitions are also written as "<name>:wait" and "<name>:hold" events (cat "LOCK"),
+// and all of them are summarized per site (contention rate, total wait, worst waiters) when the trace is saved.
+struct LockStats;
+
+class ProfiledMutex
+{
+public:
+    ProfiledMutex() = delete;
+    explicit ProfiledMutex(const std::string &name);
+    ~ProfiledMutex();
+    ProfiledMutex(const ProfiledMutex &) = delete;
+    void operator=(const ProfiledMutex &) = delete;
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+private:
+    std::mutex _mutex;
+    std::shared_ptr<LockStats> _stats;
+    // Protected by _mutex
+    uint64_t _ts_wait = 0; // 0 if the lock was not contended
+    uint64_t _ts_acquired = 0;
+};
+
+#ifdef MY_PROFILE_HAS_SHARED_MUTEX
+class ProfiledSharedMutex
+{
+public:
+    ProfiledSharedMutex() = delete;
+    explicit ProfiledSharedMutex(const std::string &name);
+    ~ProfiledSharedMutex();
+    ProfiledSharedMutex(const ProfiledSharedMutex &) = delete;
+    void operator=(const ProfiledSharedMutex &) = delete;
+
+    void lock();
+    bool try_lock();
+    void unlock();
+    void lock_shared();
+    bool try_lock_shared();
+    void unlock_shared();
+
+private:
+    std::shared_mutex _mutex;
+    std::shared_ptr<LockStats> _stats;
+    uint64_t _ts_wait = 0;
+    uint64_t _ts_acquired = 0;
+};
+#endif
+
+#define MY_PROFILE_MUTEX_NAME(NAME) (NAME + std::string(":") + std::to_string(__LINE__))
+
+// Example 3: ProfiledMutex / ProfiledSharedMutex (C++17)
+/******************************************************
+ProfiledMutex m(MY_PROFILE_MUTEX_NAME("queue_lock"));
+{
+    std::lock_guard<ProfiledMutex> lk(m);
+    ...
+}
+ProfiledSharedMutex rw(MY_PROFILE_MUTEX_NAME("cache_lock"));
+{
+    std::shared_lock<ProfiledSharedMutex> lk(rw);
+    ...
+}
+******************************************************/
+
+// Example 4: automatic function entry/exit instrumentation
+/******************************************************
+Build with: cmake -DMY_PROFILE_INSTRUMENT_FUNCTIONS=ON
+Or by hand: compile your code with -finstrument-functions, dump_profile.cpp WITHOUT it but with
+-DMY_PROFILE_INSTRUMENT_FUNCTIONS, and link with -rdynamic -ldl so the function names can be resolved.
+
+Every instrumented function call becomes a "FUNC" event, the names are resolved with dladdr
+when the trace is saved (or on a function's first exit if a filter is set). Runtime filters (environment variables):
+    MY_PROFILE_FUNC_MIN_US=5              drop calls shorter than 5 us
+    MY_PROFILE_FUNC_INCLUDE=example,foo   keep only functions whose name contains one of the items
+    MY_PROFILE_FUNC_EXCLUDE=std::         drop functions whose name contains one of the items
+The include/exclude decision is made once per function on its first recorded exit and then cached per
+thread, filtered calls never reach the trace buffer. Functions dladdr can't name (static or not exported symbols) are written as their
+address, e.g. "0x55d7b029a1db", and only match filters on that text.
+******************************************************/
+
+// Example 5: scheduler attribution
+/******************************************************
+MY_PROFILE_SCHED=1 ./app
+
+Every MyProfile scope records the voluntary/involuntary context switches, CPU migrations and minor page
+faults of its thread between entry and exit (getrusage(RUSAGE_THREAD) and a perf software event; if
+perf_event_open is not allowed, a CPU change between entry and exit counts as one migration).
+The fallback misses a migration away and back, so its arg is "cpu_migrations_approx" instead of
+"cpu_migrations" and the summary marks it "migrations(approx)"; don't trust "migrated" absent there.
+They are written as event args with a "sched" class, e.g. "preempted+migrated" or "clean", and the
+outliers of each site (> 2x its median duration) are summarized by class when the trace is saved.
+******************************************************/
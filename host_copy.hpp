@@ -0,0 +1,309 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <intrin.h>
+#include <Windows.h>
+#else
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+// Host memory copy kernels for large staging copies (e.g. Device -> Host -> Device transfers).
+//
+// host_copy_memcpy      : std::memcpy, single thread
+// host_copy_nt_avx2     : 256 bit loads + non-temporal stores, bypasses the cache for the destination
+// host_copy_nt_avx512   : 512 bit loads + non-temporal stores
+// host_copy_mt          : splits the copy into page aligned chunks over a pinned worker pool
+// host_copy             : picks one of the above by size and CPU features
+//
+// Non-temporal stores only pay off when the destination doesn't fit into the last level cache and
+// won't be read back soon, so host_copy uses them above host_copy_nt_threshold() only. That is a
+// heuristic and can be slower than std::memcpy on some hosts, measure with host_copy_test first.
+
+typedef void (*host_copy_fn)(void *dst, const void *src, size_t size);
+
+inline void host_copy_memcpy(void *dst, const void *src, size_t size)
+{
+    std::memcpy(dst, src, size);
+}
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HOST_COPY_TARGET(ISA) __attribute__((target(ISA)))
+#else
+#define HOST_COPY_TARGET(ISA)
+#endif
+
+HOST_COPY_TARGET("avx2")
+inline void host_copy_nt_avx2(void *dst, const void *src, size_t size)
+{
+    char *d = static_cast<char *>(dst);
+    const char *s = static_cast<const char *>(src);
+    // Streaming stores need an aligned destination, copy the head with memcpy
+    size_t head = std::min(size, (32 - reinterpret_cast<uintptr_t>(d) % 32) % 32);
+    std::memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128)
+    {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i + 32));
+        __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i + 64));
+        __m256i v3 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i + 96));
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(d + i), v0);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(d + i + 32), v1);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(d + i + 64), v2);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(d + i + 96), v3);
+    }
+    _mm_sfence();
+    std::memcpy(d + i, s + i, size - i);
+}
+
+HOST_COPY_TARGET("avx512f")
+inline void host_copy_nt_avx512(void *dst, const void *src, size_t size)
+{
+    char *d = static_cast<char *>(dst);
+    const char *s = static_cast<const char *>(src);
+    size_t head = std::min(size, (64 - reinterpret_cast<uintptr_t>(d) % 64) % 64);
+    std::memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    size_t i = 0;
+    for (; i + 256 <= size; i += 256)
+    {
+        __m512i v0 = _mm512_loadu_si512(s + i);
+        __m512i v1 = _mm512_loadu_si512(s + i + 64);
+        __m512i v2 = _mm512_loadu_si512(s + i + 128);
+        __m512i v3 = _mm512_loadu_si512(s + i + 192);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(d + i), v0);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(d + i + 64), v1);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(d + i + 128), v2);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(d + i + 192), v3);
+    }
+    _mm_sfence();
+    std::memcpy(d + i, s + i, size - i);
+}
+
+inline bool host_copy_has_avx2()
+{
+#if defined(__GNUC__) && !defined(_WIN32)
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+inline bool host_copy_has_avx512()
+{
+#if defined(__GNUC__) && !defined(_WIN32)
+    return __builtin_cpu_supports("avx512f");
+#else
+    return false;
+#endif
+}
+
+// The widest non-temporal kernel supported by this CPU, std::memcpy if none.
+inline host_copy_fn host_copy_nt_kernel()
+{
+    static host_copy_fn fn = host_copy_has_avx512() ? host_copy_nt_avx512 : host_copy_has_avx2() ? host_copy_nt_avx2
+                                                                                                  : host_copy_memcpy;
+    return fn;
+}
+
+// Copies above the last level cache size use non-temporal stores.
+inline size_t host_copy_nt_threshold()
+{
+    static size_t threshold = []()
+    {
+        long llc = 0;
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+        llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+        return llc > 0 ? static_cast<size_t>(llc) : static_cast<size_t>(32) * 1024 * 1024;
+    }();
+    return threshold;
+}
+
+//
+// Worker pool for multi-threaded copies. Worker i is pinned to the i-th CPU of the process affinity
+// mask, so a chunk is always copied by the same core. Together with host_copy_first_touch this places
+// the destination pages of plain malloc/new buffers on the NUMA node of the core which writes them
+// (first touch policy). It has no effect on sycl::malloc_host buffers, the driver allocates and pins
+// those pages itself.
+//
+class HostCopyPool
+{
+public:
+    explicit HostCopyPool(size_t threads = 0)
+    {
+        // Size from the process affinity mask (taskset, container cpuset), not from all CPUs of the host
+        std::vector<int> cpus = affinity_cpus();
+        if (threads == 0)
+            threads = cpus.empty() ? std::max(1u, std::thread::hardware_concurrency()) : cpus.size();
+        for (size_t i = 0; i < threads; i++)
+        {
+            _workers.emplace_back([this, i]()
+                                  { worker(i); });
+#ifndef _WIN32
+            if (!cpus.empty())
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[i % cpus.size()], &set);
+                pthread_setaffinity_np(_workers.back().native_handle(), sizeof(set), &set);
+            }
+#endif
+        }
+    }
+
+    HostCopyPool(HostCopyPool &other) = delete;
+    void operator=(const HostCopyPool &) = delete;
+    ~HostCopyPool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+        for (auto &t : _workers)
+            t.join();
+    }
+
+    size_t size() const { return _workers.size(); }
+
+    // Run fn(i) on every worker i and wait for all of them. Concurrent callers are serialized.
+    void run(const std::function<void(size_t)> &fn)
+    {
+        std::lock_guard<std::mutex> run_lk(_run_mutex);
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            _task = &fn;
+            _pending = _workers.size();
+            _generation++;
+        }
+        _cv.notify_all();
+        std::unique_lock<std::mutex> lk(_mutex);
+        _done_cv.wait(lk, [this]()
+                      { return _pending == 0; });
+        _task = nullptr;
+    }
+
+private:
+    static std::vector<int> affinity_cpus()
+    {
+        std::vector<int> cpus;
+#ifndef _WIN32
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int c = 0; c < CPU_SETSIZE; c++)
+            {
+                if (CPU_ISSET(c, &set))
+                    cpus.push_back(c);
+            }
+        }
+#endif
+        return cpus;
+    }
+
+    void worker(size_t id)
+    {
+        uint64_t seen = 0;
+        while (true)
+        {
+            const std::function<void(size_t)> *task;
+            {
+                std::unique_lock<std::mutex> lk(_mutex);
+                _cv.wait(lk, [&]()
+                         { return _stop || _generation != seen; });
+                if (_stop)
+                    return;
+                seen = _generation;
+                task = _task;
+            }
+            (*task)(id);
+            {
+                std::lock_guard<std::mutex> lk(_mutex);
+                if (--_pending == 0)
+                    _done_cv.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::mutex _run_mutex;
+    std::condition_variable _cv;
+    std::condition_variable _done_cv;
+    const std::function<void(size_t)> *_task = nullptr;
+    size_t _pending = 0;
+    uint64_t _generation = 0;
+    bool _stop = false;
+};
+
+inline HostCopyPool &host_copy_pool()
+{
+    static HostCopyPool pool;
+    return pool;
+}
+
+// Chunk [begin, end) of worker `id`, chunk borders are aligned to 4 KB pages.
+inline void host_copy_chunk(size_t size, size_t workers, size_t id, size_t &begin, size_t &end)
+{
+    constexpr size_t page = 4096;
+    size_t chunk = (size / workers + page - 1) / page * page;
+    begin = std::min(size, chunk * id);
+    end = id + 1 == workers ? size : std::min(size, begin + chunk);
+}
+
+inline void host_copy_mt(void *dst, const void *src, size_t size, host_copy_fn kernel = host_copy_memcpy, HostCopyPool &pool = host_copy_pool())
+{
+    size_t workers = pool.size();
+    pool.run([&](size_t id)
+             { size_t begin, end;
+               host_copy_chunk(size, workers, id, begin, end);
+               if (end > begin)
+                   kernel(static_cast<char *>(dst) + begin, static_cast<const char *>(src) + begin, end - begin); });
+}
+
+// Zero `ptr` with the same partition as host_copy_mt, so every page is first touched (and therefore
+// allocated on the NUMA node) by the worker that will copy into it. Only for memory whose pages are not
+// populated yet (plain malloc/new), not for USM host allocations.
+inline void host_copy_first_touch(void *ptr, size_t size, HostCopyPool &pool = host_copy_pool())
+{
+    size_t workers = pool.size();
+    pool.run([&](size_t id)
+             { size_t begin, end;
+               host_copy_chunk(size, workers, id, begin, end);
+               if (end > begin)
+                   std::memset(static_cast<char *>(ptr) + begin, 0, end - begin); });
+}
+
+// Below this size one thread is faster than waking up the pool.
+constexpr size_t host_copy_mt_threshold = 1024 * 1024;
+
+inline void host_copy(void *dst, const void *src, size_t size)
+{
+    host_copy_fn kernel = size >= host_copy_nt_threshold() ? host_copy_nt_kernel() : host_copy_memcpy;
+    if (size < host_copy_mt_threshold || host_copy_pool().size() < 2)
+        kernel(dst, src, size);
+    else
+        host_copy_mt(dst, src, size, kernel);
+}
@@ -0,0 +1,84 @@
+/*
+ * g++ -O2 -o host_copy_test host_copy_test.cpp -lpthread
+ */
+#include <chrono>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "host_copy.hpp"
+
+struct copy_variant
+{
+    std::string name;
+    std::function<void(void *, const void *, size_t)> copy;
+};
+
+// Returns the copy bandwidth in GB/s, the first loop is warm up and not counted.
+double measure(const copy_variant &v, char *dst, const char *src, size_t size)
+{
+    // Keep the total amount of copied data roughly constant over all sizes
+    size_t iterations = std::max<size_t>(10, (static_cast<size_t>(4) << 30) / size);
+    v.copy(dst, src, size);
+    const auto start = std::chrono::high_resolution_clock::now();
+    for (size_t it = 0; it < iterations; it++)
+    {
+        v.copy(dst, src, size);
+    }
+    const auto end = std::chrono::high_resolution_clock::now();
+    const std::chrono::duration<double> elapsed = end - start;
+    return size * iterations / 1024.0 / 1024.0 / 1024.0 / elapsed.count();
+}
+
+int main()
+{
+    std::vector<copy_variant> variants = {
+        {"std::memcpy", host_copy_memcpy},
+        {"host_copy_mt", [](void *d, const void *s, size_t n)
+         { host_copy_mt(d, s, n); }},
+        {"host_copy", host_copy},
+    };
+    if (host_copy_has_avx2())
+    {
+        variants.push_back({"nt_avx2", host_copy_nt_avx2});
+        variants.push_back({"host_copy_mt(nt_avx2)", [](void *d, const void *s, size_t n)
+                            { host_copy_mt(d, s, n, host_copy_nt_avx2); }});
+    }
+    if (host_copy_has_avx512())
+    {
+        variants.push_back({"nt_avx512", host_copy_nt_avx512});
+        variants.push_back({"host_copy_mt(nt_avx512)", [](void *d, const void *s, size_t n)
+                            { host_copy_mt(d, s, n, host_copy_nt_avx512); }});
+    }
+
+    std::cout << "Host copy: " << host_copy_pool().size() << " pinned workers, non-temporal threshold = "
+              << host_copy_nt_threshold() / 1024 << " KB" << std::endl;
+
+    // L1, L2, LLC and DRAM sized copies
+    for (size_t size : {16ul << 10, 256ul << 10, 4ul << 20, 64ul << 20, 512ul << 20})
+    {
+        char *src = static_cast<char *>(std::malloc(size));
+        char *dst = static_cast<char *>(std::malloc(size));
+        host_copy_first_touch(src, size);
+        host_copy_first_touch(dst, size);
+        std::memset(src, 10, size);
+
+        std::cout << "\tsize = " << size / 1024 << " KB" << std::endl;
+        double baseline = 0;
+        for (auto &v : variants)
+        {
+            std::memset(dst, 0, size);
+            double bw = measure(v, dst, src, size);
+            if (baseline == 0)
+                baseline = bw;
+            bool ok = std::memcmp(dst, src, size) == 0;
+            std::cout << "\t\t" << v.name << ": bandwidth = " << bw << " GB/s, " << bw / baseline << "x"
+                      << (ok ? "" : ", Failed: dst != src") << std::endl;
+        }
+        std::free(src);
+        std::free(dst);
+    }
+    std::cout << std::endl;
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "dump_profile.hpp"
 #include <chrono>
 #include <thread>
+#include <vector>
 
 void example_1()
 {
@@ -28,9 +29,29 @@ void example_2()
         std::this_thread::sleep_for(std::chrono::milliseconds(30));
     }
 }
+void example_3()
+{
+    // Example: ProfiledMutex, 4 threads contending on one lock
+    ProfiledMutex m(MY_PROFILE_MUTEX_NAME("counter_lock"));
+    size_t counter = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++)
+    {
+        threads.emplace_back([&]()
+                             { for (int j = 0; j < 100; j++)
+                               {
+                                   std::lock_guard<ProfiledMutex> lk(m);
+                                   counter++;
+                                   std::this_thread::sleep_for(std::chrono::microseconds(10));
+                               } });
+    }
+    for (auto &t : threads)
+        t.join();
+}
 int main(int argc, char **argv)
 {
     example_1();
     example_2();
+    example_3();
     return 0;
 }
\ No newline at end of file
@@ -6,7 +6,13 @@
 #include <iostream>
 #include <cstring>
 #include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <sys/resource.h>
 #include <sycl/sycl.hpp>
+#include "host_copy.hpp"
+#include "usm_pool.hpp"
 
 using namespace std::chrono_literals;
 std::vector<sycl::device> g_devices;
@@ -458,7 +464,8 @@ void test_host_to_device(size_t w, size_t h, size_t iterations)
     sycl::free(usm_host_ptr_b, q);
 }
 
-void test_device_to_host_to_device(size_t w, size_t h, size_t iterations)
+// `copy` is the Host -> Host staging copy, std::memcpy by default; host_copy is reported as a separate variant
+void test_device_to_host_to_device(size_t w, size_t h, size_t iterations, host_copy_fn copy = host_copy_memcpy, const char *copy_name = "std::memcpy")
 {
     sycl::queue q1(g_devices[0]);
     size_t size = w * h;
@@ -485,7 +492,7 @@ void test_device_to_host_to_device(size_t w, size_t h, size_t iterations)
     {
         start = std::chrono::high_resolution_clock::now();
         q1.memcpy(usm_host_ptr_b1, usm_device_ptr_a, size * sizeof(char)).wait();
-        std::memcpy(usm_host_ptr_b2, usm_host_ptr_b1, size * sizeof(char));
+        copy(usm_host_ptr_b2, usm_host_ptr_b1, size * sizeof(char));
         q2.memcpy(usm_device_ptr_c, usm_host_ptr_b2, size * sizeof(char)).wait();
         end = std::chrono::high_resolution_clock::now();
         elapsed += end - start;
@@ -504,7 +511,7 @@ void test_device_to_host_to_device(size_t w, size_t h, size_t iterations)
             break;
         }
     }
-    std::cout << "\tDevice -> Host -> Device transfer(DMA): data size = " << size * sizeof(char) << ", cost: " << elapsed.count() / iterations << " ms, first_loop = " << fisrt_elapsed.count() << " ms, bandwidth = "
+    std::cout << "\tDevice -> Host -> Device transfer(DMA, " << copy_name << "): data size = " << size * sizeof(char) << ", cost: " << elapsed.count() / iterations << " ms, first_loop = " << fisrt_elapsed.count() << " ms, bandwidth = "
               << size * iterations * sizeof(char) * 1000 / 1024 / 1024 / elapsed.count() << " MB/s" << std::endl;
     std::cout << std::endl;
     sycl::free(usm_device_ptr_a, q1);
@@ -513,6 +520,151 @@ void test_device_to_host_to_device(size_t w, size_t h, size_t iterations)
     sycl::free(usm_device_ptr_c, q2);
 }
 
+//
+// Pipelined Device -> Host -> Device transfer
+//
+//   q1: D2H(k)  D2H(k+1) D2H(k+2)
+//   q2:         host(k)  host(k+1) ...
+//   q2:                  H2D(k)    H2D(k+1) ...
+//
+// The buffer is split into `chunks` pieces which are streamed through `stages` host staging slots
+// (2 = double buffering, 3 = triple buffering). Every step only depends on events of the steps that
+// produce its input or still read its staging slot, so the host never waits inside one iteration.
+//
+double run_device_to_host_to_device_pipelined(sycl::queue &q1, sycl::queue &q2, char *src, char *stage1, char *stage2, char *dst,
+                                              size_t size, size_t chunks, size_t stages)
+{
+    size_t chunk_size = (size + chunks - 1) / chunks;
+    // The last event which touched each staging slot
+    std::vector<sycl::event> host_done(stages), h2d_done(stages);
+    std::vector<bool> slot_used(stages, false);
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    for (size_t k = 0; k < chunks; k++)
+    {
+        size_t offset = k * chunk_size;
+        if (offset >= size)
+            break;
+        size_t bytes = std::min(chunk_size, size - offset);
+        size_t slot = k % stages;
+        char *s1 = stage1 + slot * chunk_size;
+        char *s2 = stage2 + slot * chunk_size;
+
+        // D2H(k) overwrites stage1[slot], so the previous host copy from that slot must be done.
+        std::vector<sycl::event> deps;
+        if (slot_used[slot])
+            deps.push_back(host_done[slot]);
+        auto d2h = q1.memcpy(s1, src + offset, bytes, deps);
+
+        // Host copy(k) overwrites stage2[slot], so the previous H2D from that slot must be done.
+        deps = {d2h};
+        if (slot_used[slot])
+            deps.push_back(h2d_done[slot]);
+        host_done[slot] = q2.submit([&](sycl::handler &h)
+                                    { h.depends_on(deps);
+                                      h.host_task([=]()
+                                                  { std::memcpy(s2, s1, bytes); }); });
+
+        h2d_done[slot] = q2.memcpy(dst + offset, s2, bytes, host_done[slot]);
+        slot_used[slot] = true;
+    }
+    for (size_t i = 0; i < stages; i++)
+    {
+        if (slot_used[i])
+            h2d_done[i].wait();
+    }
+    const auto end = std::chrono::high_resolution_clock::now();
+    const std::chrono::duration<double, std::milli> elapsed = end - start;
+    return elapsed.count();
+}
+
+void test_device_to_host_to_device_pipelined(size_t w, size_t h, size_t iterations, size_t chunks)
+{
+    size_t size = w * h;
+    size_t chunk_size = (size + chunks - 1) / chunks;
+    constexpr size_t max_stages = 3;
+
+    // Serialized reference: same data path as test_device_to_host_to_device, with .wait() after each step
+    double serialized = 0;
+    {
+        sycl::queue q1(g_devices[0]);
+        sycl::queue q2(g_devices[1]);
+        char *usm_device_ptr_a = sycl::malloc_device<char>(size, q1, {});
+        char *usm_host_ptr_b1 = sycl::malloc_host<char>(size, q1, {});
+        char *usm_host_ptr_b2 = sycl::malloc_host<char>(size, q2, {});
+        char *usm_device_ptr_c = sycl::malloc_device<char>(size, q2, {});
+        q1.memset(usm_device_ptr_a, 10, size * sizeof(char)).wait();
+
+        size_t it = 0;
+        while (it++ <= iterations)
+        {
+            const auto start = std::chrono::high_resolution_clock::now();
+            q1.memcpy(usm_host_ptr_b1, usm_device_ptr_a, size * sizeof(char)).wait();
+            std::memcpy(usm_host_ptr_b2, usm_host_ptr_b1, size * sizeof(char));
+            q2.memcpy(usm_device_ptr_c, usm_host_ptr_b2, size * sizeof(char)).wait();
+            const auto end = std::chrono::high_resolution_clock::now();
+            // Skip the first loop, it includes page mapping and driver warm up
+            if (it > 1)
+                serialized += std::chrono::duration<double, std::milli>(end - start).count();
+        }
+        serialized /= iterations;
+
+        sycl::free(usm_device_ptr_a, q1);
+        sycl::free(usm_host_ptr_b1, q1);
+        sycl::free(usm_host_ptr_b2, q2);
+        sycl::free(usm_device_ptr_c, q2);
+    }
+    std::cout << "\tDevice -> Host -> Device serialized: data size = " << size * sizeof(char) << ", cost: " << serialized << " ms, bandwidth = "
+              << size * sizeof(char) * 1000 / 1024 / 1024 / serialized << " MB/s" << std::endl;
+
+    for (bool in_order : {false, true})
+    {
+        sycl::property_list props = in_order ? sycl::property_list{sycl::property::queue::in_order()} : sycl::property_list{};
+        sycl::queue q1(g_devices[0], props);
+        sycl::queue q2(g_devices[1], props);
+        char *usm_device_ptr_a = usm_pool(q1, sycl::usm::alloc::device).allocate<char>(size);
+        char *usm_host_ptr_b1 = usm_pool(q1, sycl::usm::alloc::host).allocate<char>(chunk_size * max_stages);
+        char *usm_host_ptr_b2 = usm_pool(q2, sycl::usm::alloc::host).allocate<char>(chunk_size * max_stages);
+        char *usm_device_ptr_c = usm_pool(q2, sycl::usm::alloc::device).allocate<char>(size);
+        q1.memset(usm_device_ptr_a, 10, size * sizeof(char)).wait();
+
+        for (size_t stages = 2; stages <= max_stages; stages++)
+        {
+            q2.memset(usm_device_ptr_c, 0, size * sizeof(char)).wait();
+            double pipelined = 0;
+            size_t it = 0;
+            while (it++ <= iterations)
+            {
+                double cost = run_device_to_host_to_device_pipelined(q1, q2, usm_device_ptr_a, usm_host_ptr_b1, usm_host_ptr_b2, usm_device_ptr_c,
+                                                                     size, chunks, stages);
+                if (it > 1)
+                    pipelined += cost;
+            }
+            pipelined /= iterations;
+
+            std::vector<char> check(size);
+            q2.memcpy(check.data(), usm_device_ptr_c, size * sizeof(char)).wait();
+            for (size_t i = 0; i < size; i++)
+            {
+                if (check[i] != 10)
+                {
+                    std::cout << "Failed at " << i << std::endl;
+                    break;
+                }
+            }
+            std::cout << "\tDevice -> Host -> Device pipelined(" << (in_order ? "in-order" : "out-of-order") << ", chunks = " << chunks
+                      << ", stages = " << stages << "): cost: " << pipelined << " ms, bandwidth = "
+                      << size * sizeof(char) * 1000 / 1024 / 1024 / pipelined << " MB/s, overlap gain = " << serialized / pipelined << "x" << std::endl;
+        }
+
+        usm_pool(q1, sycl::usm::alloc::device).deallocate(usm_device_ptr_a);
+        usm_pool(q1, sycl::usm::alloc::host).deallocate(usm_host_ptr_b1);
+        usm_pool(q2, sycl::usm::alloc::host).deallocate(usm_host_ptr_b2);
+        usm_pool(q2, sycl::usm::alloc::device).deallocate(usm_device_ptr_c);
+    }
+    std::cout << std::endl;
+}
+
 void test_host_to_device_concat(size_t w, size_t h, size_t iterations)
 {
     sycl::queue q(g_devices[0]);
@@ -553,6 +705,226 @@ void test_host_to_device_concat(size_t w, size_t h, size_t iterations)
     sycl::free(usm_host_ptr_b, q);
 }
 
+// Gather kernel 2D copy, used by memcpy_2d when ext_oneapi_memcpy2d is not available.
+// One work item per byte, rows are the slow dimension.
+sycl::event memcpy_2d_kernel(sycl::queue &q, char *dst, size_t dst_pitch, const char *src, size_t src_pitch, size_t width, size_t height,
+                             const std::vector<sycl::event> &deps = {})
+{
+    return q.submit([&](sycl::handler &h)
+                    { h.depends_on(deps);
+                      h.parallel_for(sycl::range<2>(height, width), [=](sycl::id<2> i)
+                                     { dst[i[0] * dst_pitch + i[1]] = src[i[0] * src_pitch + i[1]]; }); });
+}
+
+//
+// Strided 2D copy: `height` rows of `width` bytes, source rows are `src_pitch` bytes apart and
+// destination rows are `dst_pitch` bytes apart. All rows are copied by one operation instead of
+// one memcpy per row. Pointers must be USM allocations accessible from the queue's device.
+//
+sycl::event memcpy_2d(sycl::queue &q, char *dst, size_t dst_pitch, const char *src, size_t src_pitch, size_t width, size_t height,
+                      const std::vector<sycl::event> &deps = {})
+{
+#ifdef SYCL_EXT_ONEAPI_MEMCPY2D
+    return q.ext_oneapi_memcpy2d(dst, dst_pitch, src, src_pitch, width, height, deps);
+#else
+    return memcpy_2d_kernel(q, dst, dst_pitch, src, src_pitch, width, height, deps);
+#endif
+}
+
+//
+// Per-row copies vs. batched 2D copies for tensor concat:
+//
+//   dst row i = [ A row i (w bytes) | B row i (w bytes) ],  B is stored contiguously (pitch = w)
+//
+// w is swept to find the row width where batching pays off.
+//
+void test_concat_copy2d(size_t h, size_t iterations)
+{
+    sycl::queue q(g_devices[0]);
+    std::cout << "Q Running on " << q.get_device().get_info<sycl::info::device::name>() << "\n";
+#ifdef SYCL_EXT_ONEAPI_MEMCPY2D
+    std::cout << "\tmemcpy_2d uses ext_oneapi_memcpy2d" << std::endl;
+#else
+    std::cout << "\tmemcpy_2d uses gather kernel" << std::endl;
+#endif
+
+    auto &device_pool = usm_pool(q, sycl::usm::alloc::device);
+    auto &host_pool = usm_pool(q, sycl::usm::alloc::host);
+    auto &shared_pool = usm_pool(q, sycl::usm::alloc::shared);
+    for (size_t w : {64, 256, 1024, 4096, 16384})
+    {
+        size_t size = 2 * w * h;
+        char *usm_device_ptr_dst = device_pool.allocate<char>(size);
+        char *usm_host_ptr_src = host_pool.allocate<char>(size / 2);
+        char *usm_shared_ptr_dst = shared_pool.allocate<char>(size);
+        char *usm_shared_ptr_src = shared_pool.allocate<char>(size / 2);
+        std::memset(usm_host_ptr_src, 10, size / 2);
+        std::memset(usm_shared_ptr_src, 10, size / 2);
+        q.memset(usm_device_ptr_dst, 0, size).wait();
+        std::memset(usm_shared_ptr_dst, 0, size);
+
+        // Returns the average cost [ms] of one concat, the first loop is warm up and not counted.
+        auto measure = [&](const std::function<void()> &copy)
+        {
+            std::chrono::duration<double, std::milli> elapsed(0);
+            size_t it = 0;
+            while (it++ <= iterations)
+            {
+                const auto start = std::chrono::high_resolution_clock::now();
+                copy();
+                const auto end = std::chrono::high_resolution_clock::now();
+                if (it > 1)
+                    elapsed += end - start;
+            }
+            return elapsed.count() / iterations;
+        };
+
+        // Host -> Device: h separate q.memcpy (test_host_to_device_concat) vs. one 2D copy
+        double h2d_per_row = measure([&]()
+                                     { for (size_t i = 0; i < h; i++)
+                                           q.memcpy(usm_device_ptr_dst + 2 * w * i + w, usm_host_ptr_src + w * i, w);
+                                       q.wait(); });
+        double h2d_batched = measure([&]()
+                                     { memcpy_2d(q, usm_device_ptr_dst + w, 2 * w, usm_host_ptr_src, w, w, h).wait(); });
+        double h2d_kernel = measure([&]()
+                                    { memcpy_2d_kernel(q, usm_device_ptr_dst + w, 2 * w, usm_host_ptr_src, w, w, h).wait(); });
+
+        // Shared USM: host std::memcpy row loop (test_device_to_device_concat) vs. one 2D copy
+        double shared_per_row = measure([&]()
+                                        { for (size_t i = 0; i < h; i++)
+                                              std::memcpy(usm_shared_ptr_dst + 2 * w * i + w, usm_shared_ptr_src + w * i, w); });
+        double shared_batched = measure([&]()
+                                        { memcpy_2d(q, usm_shared_ptr_dst + w, 2 * w, usm_shared_ptr_src, w, w, h).wait(); });
+
+        std::vector<char> check(size);
+        q.memcpy(check.data(), usm_device_ptr_dst, size).wait();
+        for (size_t i = 0; i < h; i++)
+        {
+            if (check[2 * w * i + w] != 10 || check[2 * w * i] != 0 || usm_shared_ptr_dst[2 * w * i + w] != 10 || usm_shared_ptr_dst[2 * w * i] != 0)
+            {
+                std::cout << "Failed at row " << i << std::endl;
+                break;
+            }
+        }
+
+        std::cout << "\tConcat row width = " << w << ", rows = " << h << ", data size = " << size / 2 << std::endl;
+        std::cout << "\t\tHost -> Device: per_row = " << h2d_per_row << " ms, memcpy_2d = " << h2d_batched << " ms, gather kernel = " << h2d_kernel
+                  << " ms, speedup = " << h2d_per_row / h2d_batched << "x" << std::endl;
+        std::cout << "\t\tShared USM:     per_row = " << shared_per_row << " ms, memcpy_2d = " << shared_batched
+                  << " ms, speedup = " << shared_per_row / shared_batched << "x" << std::endl;
+
+        device_pool.deallocate(usm_device_ptr_dst);
+        host_pool.deallocate(usm_host_ptr_src);
+        shared_pool.deallocate(usm_shared_ptr_dst);
+        shared_pool.deallocate(usm_shared_ptr_src);
+    }
+    std::cout << std::endl;
+}
+
+static long minor_page_faults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+//
+// USM allocation churn: raw sycl::malloc/sycl::free latency vs. UsmPool reuse, and the first touch
+// cost of a fresh allocation compared with touching it again.
+// For shared allocations the host first touch, device write and host read back are reported with
+// the minor page faults they caused, the device -> host read back includes page migration.
+//
+void test_usm_alloc_latency(size_t iterations)
+{
+    sycl::queue q(g_devices[0]);
+    std::cout << "Q Running on " << q.get_device().get_info<sycl::info::device::name>() << "\n";
+    using ms = std::chrono::duration<double, std::milli>;
+
+    for (auto kind : {sycl::usm::alloc::host, sycl::usm::alloc::device, sycl::usm::alloc::shared})
+    {
+        const char *kind_name = kind == sycl::usm::alloc::host ? "host" : kind == sycl::usm::alloc::device ? "device"
+                                                                                                          : "shared";
+        auto &pool = usm_pool(q, kind);
+        for (size_t size : {4ul << 10, 64ul << 10, 1ul << 20, 16ul << 20, 256ul << 20})
+        {
+            // Raw allocation latency
+            ms alloc_cost(0), free_cost(0);
+            for (size_t it = 0; it < iterations; it++)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                char *ptr = static_cast<char *>(sycl::malloc(size, q, kind));
+                auto end = std::chrono::high_resolution_clock::now();
+                alloc_cost += end - start;
+                start = std::chrono::high_resolution_clock::now();
+                sycl::free(ptr, q);
+                end = std::chrono::high_resolution_clock::now();
+                free_cost += end - start;
+            }
+
+            // Pooled allocation latency, the first allocation fills the pool and is not counted
+            pool.deallocate(pool.allocate(size));
+            ms pool_cost(0);
+            for (size_t it = 0; it < iterations; it++)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                pool.deallocate(pool.allocate(size));
+                auto end = std::chrono::high_resolution_clock::now();
+                pool_cost += end - start;
+            }
+
+            // First touch vs. second touch of a fresh allocation
+            char *ptr = static_cast<char *>(sycl::malloc(size, q, kind));
+            ms touch_cost[2];
+            long touch_faults[2];
+            for (int i = 0; i < 2; i++)
+            {
+                long faults = minor_page_faults();
+                auto start = std::chrono::high_resolution_clock::now();
+                if (kind == sycl::usm::alloc::device)
+                    q.memset(ptr, i, size).wait();
+                else
+                    std::memset(ptr, i, size);
+                auto end = std::chrono::high_resolution_clock::now();
+                touch_cost[i] = end - start;
+                touch_faults[i] = minor_page_faults() - faults;
+            }
+
+            std::cout << "\tUSM " << kind_name << ": size = " << size / 1024 << " KB, malloc = " << alloc_cost.count() * 1000 / iterations
+                      << " us, free = " << free_cost.count() * 1000 / iterations << " us, pooled malloc+free = " << pool_cost.count() * 1000 / iterations
+                      << " us, first touch = " << touch_cost[0].count() << " ms (" << touch_faults[0] << " page faults), second touch = "
+                      << touch_cost[1].count() << " ms (" << touch_faults[1] << " page faults)" << std::endl;
+
+            if (kind == sycl::usm::alloc::shared)
+            {
+                // Device write migrates the pages to the device, the host read back migrates them again
+                auto start = std::chrono::high_resolution_clock::now();
+                q.submit([&](sycl::handler &h)
+                         { h.parallel_for(sycl::range<1>(size), [=](sycl::id<1> i)
+                                          { ptr[i] = 10; }); })
+                    .wait();
+                auto end = std::chrono::high_resolution_clock::now();
+                ms device_write = end - start;
+
+                long faults = minor_page_faults();
+                start = std::chrono::high_resolution_clock::now();
+                size_t sum = 0;
+                for (size_t i = 0; i < size; i += 64)
+                    sum += ptr[i];
+                end = std::chrono::high_resolution_clock::now();
+                ms host_read = end - start;
+                faults = minor_page_faults() - faults;
+                if (sum != (size + 63) / 64 * 10)
+                    std::cout << "Failed: shared read back sum = " << sum << std::endl;
+                std::cout << "\t\tshared migration: device write = " << device_write.count() << " ms, host read back = " << host_read.count()
+                          << " ms (" << faults << " page faults)" << std::endl;
+            }
+            sycl::free(ptr, q);
+        }
+        std::cout << "\tUSM " << kind_name << " pool: hits = " << pool.hits() << ", misses = " << pool.misses() << std::endl;
+    }
+    std::cout << std::endl;
+}
+
 int main()
 {
     init();
@@ -569,5 +941,10 @@ int main()
     // test_device_to_device_element_add_ND(1024, 1024, 100);
     test_host_to_device(1024, 1024, 100);
     test_device_to_host_to_device(1024,1024,100);
+    test_device_to_host_to_device(1024, 1024, 100, host_copy, "host_copy");
+    test_device_to_host_to_device_pipelined(1024, 1024, 100, 8);
     test_host_to_device_concat(1024, 1024, 100);
+    test_concat_copy2d(1024, 100);
+    test_usm_alloc_latency(100);
+    usm_pool_release_all();
 }
@@ -0,0 +1,554 @@
+/*
+ * Compare two profile traces and flag performance regressions per site.
+ *
+ * trace_compare [options] <base_trace> <new_trace>
+ *   --metric mean|p50|p99   metric which must regress to flag a site (default: mean)
+ *   --threshold PCT         minimal relative regression of the metric in percent (default: 5)
+ *   --alpha P               significance level of the test for the metric (default: 0.05)
+ *   --min-count N           ignore sites with less than N events in one of the traces (default: 2)
+ * trace_compare --self-test  check the regression gate on synthetic traces
+ *
+ * The significance test matches the metric: Welch's t-test for the mean, and for p50/p99 a quantile
+ * test (two-proportion z-test of the fraction of events above the base trace's quantile). A tail
+ * regression that leaves the mean unchanged is found by p99 only.
+ *
+ * Exit status: 0 = no regression, 1 = at least one site regressed, 2 = usage or read error.
+ *
+ * Traces are streamed event by event, per site only running moments and a log bucketed duration
+ * histogram (~1% resolution) are kept, so the memory use depends on the number of sites only.
+ */
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct trace_event
+{
+    std::string name;
+    double dur = 0; // [microsecond]
+};
+
+// Reads the events of one trace, one by one.
+class TraceReader
+{
+public:
+    virtual ~TraceReader() = default;
+    // Returns false at the end of the trace. Events without duration are skipped by the reader.
+    virtual bool next(trace_event &ev) = 0;
+    // Non empty if the trace is malformed.
+    const std::string &error() const { return _error; }
+
+protected:
+    std::string _error;
+};
+
+//
+// Streaming reader for Trace Event Format json, as written by ProfilerManager::save_to_json:
+// {"traceEvents":[{"name":"..","ph":"X","dur":"..",..,"args":{..}},..]}
+// Only "name" and "dur" of the complete ('X') events are used, every other value is skipped.
+//
+class JsonTraceReader : public TraceReader
+{
+public:
+    explicit JsonTraceReader(FILE *pf) : _pf(pf) {}
+
+    bool next(trace_event &ev) override
+    {
+        if (!_in_events && !find_events())
+            return false;
+        while (true)
+        {
+            int c = skip_ws();
+            if (c == ',')
+                c = skip_ws();
+            if (c == ']' || c == EOF)
+                return false;
+            if (c != '{')
+                return fail("expect '{' at the start of an event");
+
+            bool has_dur = false;
+            std::string ph = "X";
+            ev.name.clear();
+            ev.dur = 0;
+            std::string key, value;
+            while (true)
+            {
+                c = skip_ws();
+                if (c == '}')
+                    break;
+                if (c == ',')
+                    c = skip_ws();
+                if (c != '"' || !read_string(key))
+                    return fail("expect a key string");
+                if (skip_ws() != ':')
+                    return fail("expect ':' after key " + key);
+                if (key == "name" || key == "dur" || key == "ph")
+                {
+                    if (!read_scalar(value))
+                        return fail("expect a scalar value for " + key);
+                    if (key == "name")
+                        ev.name = value;
+                    else if (key == "ph")
+                        ph = value;
+                    else
+                    {
+                        ev.dur = std::strtod(value.c_str(), nullptr);
+                        has_dur = true;
+                    }
+                }
+                else if (!skip_value())
+                    return fail("malformed value of " + key);
+            }
+            if (has_dur && ph == "X")
+                return true;
+        }
+    }
+
+private:
+    bool fail(const std::string &msg)
+    {
+        _error = msg;
+        return false;
+    }
+
+    int get() { return fgetc(_pf); }
+
+    int skip_ws()
+    {
+        int c;
+        do
+        {
+            c = get();
+        } while (c == ' ' || c == '\n' || c == '\r' || c == '\t');
+        return c;
+    }
+
+    // Seek to the first element of the "traceEvents" array.
+    bool find_events()
+    {
+        std::string key;
+        if (skip_ws() != '{')
+            return fail("expect a json object");
+        while (true)
+        {
+            int c = skip_ws();
+            if (c == ',')
+                c = skip_ws();
+            if (c != '"' || !read_string(key))
+                return fail("no traceEvents array");
+            if (skip_ws() != ':')
+                return fail("expect ':' after key " + key);
+            if (key == "traceEvents")
+                break;
+            if (!skip_value())
+                return fail("malformed value of " + key);
+        }
+        if (skip_ws() != '[')
+            return fail("traceEvents is not an array");
+        _in_events = true;
+        return true;
+    }
+
+    // The opening quote is already consumed.
+    bool read_string(std::string &s)
+    {
+        s.clear();
+        int c;
+        while ((c = get()) != EOF)
+        {
+            if (c == '"')
+                return true;
+            if (c == '\\')
+            {
+                c = get();
+                if (c == EOF)
+                    break;
+                if (c == 'n')
+                    c = '\n';
+                else if (c == 't')
+                    c = '\t';
+            }
+            s.push_back(static_cast<char>(c));
+        }
+        return false;
+    }
+
+    // String, number, true/false/null. The value is returned as text.
+    bool read_scalar(std::string &s)
+    {
+        int c = skip_ws();
+        if (c == '"')
+            return read_string(s);
+        s.clear();
+        while (c != EOF && c != ',' && c != '}' && c != ']' && c != ' ' && c != '\n' && c != '\r' && c != '\t')
+        {
+            s.push_back(static_cast<char>(c));
+            c = get();
+        }
+        if (c != EOF)
+            ungetc(c, _pf);
+        return !s.empty();
+    }
+
+    bool skip_value()
+    {
+        int c = skip_ws();
+        if (c == '"')
+        {
+            std::string s;
+            return read_string(s);
+        }
+        if (c == '{' || c == '[')
+        {
+            // Skip the nested object/array, strings may contain brackets
+            int depth = 1;
+            std::string s;
+            while (depth > 0 && (c = get()) != EOF)
+            {
+                if (c == '"' && !read_string(s))
+                    return false;
+                else if (c == '{' || c == '[')
+                    depth++;
+                else if (c == '}' || c == ']')
+                    depth--;
+            }
+            return depth == 0;
+        }
+        ungetc(c, _pf);
+        std::string s;
+        return read_scalar(s);
+    }
+
+    FILE *_pf;
+    bool _in_events = false;
+};
+
+// Log bucketed histogram, bucket i holds durations in [base^i, base^(i+1)) nanoseconds.
+class DurationHistogram
+{
+public:
+    void add(double dur_us)
+    {
+        double ns = dur_us * 1000.0;
+        int bucket = ns < 1.0 ? -1 : static_cast<int>(std::log(ns) / std::log(base));
+        _buckets[bucket]++;
+        _count++;
+    }
+
+    // Approximate q-quantile [microsecond], the geometric middle of the bucket.
+    double quantile(double q) const
+    {
+        int bucket = quantile_bucket(q);
+        return bucket < 0 ? 0 : std::pow(base, bucket + 0.5) / 1000.0;
+    }
+
+    // The bucket holding the q-quantile, -1 if it is below 1 ns or the histogram is empty.
+    int quantile_bucket(double q) const
+    {
+        if (_count == 0)
+            return -1;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * _count));
+        if (rank == 0)
+            rank = 1;
+        uint64_t seen = 0;
+        for (auto &b : _buckets)
+        {
+            seen += b.second;
+            if (seen >= rank)
+                return b.first;
+        }
+        return -1;
+    }
+
+    // Number of durations in buckets above `bucket`.
+    uint64_t count_above(int bucket) const
+    {
+        uint64_t n = 0;
+        for (auto it = _buckets.upper_bound(bucket); it != _buckets.end(); ++it)
+            n += it->second;
+        return n;
+    }
+
+    uint64_t count() const { return _count; }
+
+private:
+    static constexpr double base = 1.01;
+    std::map<int, uint64_t> _buckets;
+    uint64_t _count = 0;
+};
+
+struct site_stats
+{
+    uint64_t count = 0;
+    double mean = 0;
+    double m2 = 0; // Sum of squared differences from the mean (Welford)
+    DurationHistogram hist;
+
+    void add(double dur)
+    {
+        count++;
+        double delta = dur - mean;
+        mean += delta / count;
+        m2 += delta * (dur - mean);
+        hist.add(dur);
+    }
+
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0; }
+};
+
+// Regularized incomplete beta function I_x(a, b), continued fraction (Numerical Recipes 6.4).
+static double incomplete_beta(double a, double b, double x)
+{
+    if (x <= 0)
+        return 0;
+    if (x >= 1)
+        return 1;
+    if (x > (a + 1) / (a + b + 2))
+        return 1 - incomplete_beta(b, a, 1 - x);
+
+    const double eps = 1e-12, tiny = 1e-300;
+    double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log(1 - x)) / a;
+    double f = 1, c = 1, d = 0;
+    for (int i = 0; i <= 400; i++)
+    {
+        int m = i / 2;
+        double num;
+        if (i == 0)
+            num = 1;
+        else if (i % 2 == 0)
+            num = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+        else
+            num = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+        d = 1 + num * d;
+        d = std::fabs(d) < tiny ? tiny : d;
+        d = 1 / d;
+        c = 1 + num / c;
+        c = std::fabs(c) < tiny ? tiny : c;
+        double cd = c * d;
+        f *= cd;
+        if (std::fabs(1 - cd) < eps)
+            break;
+    }
+    return front * (f - 1);
+}
+
+// Two sided p-value of Welch's t-test for different means.
+static double welch_p_value(const site_stats &a, const site_stats &b)
+{
+    if (a.count < 2 || b.count < 2)
+        return 1;
+    double va = a.variance() / a.count;
+    double vb = b.variance() / b.count;
+    if (va + vb <= 0)
+        return a.mean == b.mean ? 1 : 0;
+    double t = (b.mean - a.mean) / std::sqrt(va + vb);
+    double df = (va + vb) * (va + vb) / (va * va / (a.count - 1) + vb * vb / (b.count - 1));
+    return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+// Two sided p-value of a quantile test: are the events of b above a's q-quantile a different fraction
+// than those of a? Two-proportion z-test on the histogram counts, so p50/p99 shifts are tested directly.
+static double quantile_p_value(const site_stats &a, const site_stats &b, double q)
+{
+    if (a.count < 2 || b.count < 2)
+        return 1;
+    int bucket = a.hist.quantile_bucket(q);
+    double na = static_cast<double>(a.hist.count()), nb = static_cast<double>(b.hist.count());
+    double fa = a.hist.count_above(bucket) / na;
+    double fb = b.hist.count_above(bucket) / nb;
+    double pooled = (fa * na + fb * nb) / (na + nb);
+    double se = std::sqrt(pooled * (1 - pooled) * (1 / na + 1 / nb));
+    if (se <= 0)
+        return fa == fb ? 1 : 0;
+    return std::erfc(std::fabs(fb - fa) / se / std::sqrt(2.0));
+}
+
+static bool load_trace(const char *fn, std::map<std::string, site_stats> &sites)
+{
+    FILE *pf = fopen(fn, "rb");
+    if (nullptr == pf)
+    {
+        printf("Can't fopen:%s\n", fn);
+        return false;
+    }
+    // Only json is written today, other formats get their own TraceReader.
+    std::unique_ptr<TraceReader> reader(new JsonTraceReader(pf));
+    trace_event ev;
+    uint64_t events = 0;
+    while (reader->next(ev))
+    {
+        sites[ev.name].add(ev.dur);
+        events++;
+    }
+    fclose(pf);
+    if (!reader->error().empty())
+    {
+        printf("Failed to read %s after %llu events: %s\n", fn, static_cast<unsigned long long>(events), reader->error().c_str());
+        return false;
+    }
+    return true;
+}
+
+static double metric_of(const site_stats &s, const std::string &metric)
+{
+    if (metric == "p50")
+        return s.hist.quantile(0.5);
+    if (metric == "p99")
+        return s.hist.quantile(0.99);
+    return s.mean;
+}
+
+static double delta_pct(double base, double cur)
+{
+    return base > 0 ? (cur - base) * 100.0 / base : 0;
+}
+
+static double p_value_of(const site_stats &s0, const site_stats &s1, const std::string &metric)
+{
+    if (metric == "p50")
+        return quantile_p_value(s0, s1, 0.5);
+    if (metric == "p99")
+        return quantile_p_value(s0, s1, 0.99);
+    return welch_p_value(s0, s1);
+}
+
+struct gate_options
+{
+    std::string metric = "mean";
+    double threshold = 5.0;
+    double alpha = 0.05;
+    uint64_t min_count = 2;
+};
+
+static bool regressed(const site_stats &s0, const site_stats &s1, const gate_options &opt, double &p)
+{
+    p = p_value_of(s0, s1, opt.metric);
+    double delta = delta_pct(metric_of(s0, opt.metric), metric_of(s1, opt.metric));
+    return s0.count >= opt.min_count && s1.count >= opt.min_count && delta > opt.threshold && p < opt.alpha;
+}
+
+// Synthetic sites with a known answer, 2000 vs 2000 events.
+static int self_test()
+{
+    uint64_t seed = 1;
+    auto noise = [&seed]()
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        return static_cast<double>(seed >> 11) / 9007199254740992.0 * 20.0 - 10.0; // [-10, 10)
+    };
+    site_stats base, same, tail, shift;
+    for (int i = 0; i < 2000; i++)
+    {
+        base.add(100 + noise());
+        same.add(100 + noise());
+        shift.add(120 + noise());
+        // 2% of the events at 200 us, the body 2 us faster: the mean stays at ~100 us, p99 doubles
+        tail.add(i % 50 == 0 ? 200 + noise() : 98 + noise());
+    }
+
+    struct check
+    {
+        const char *name;
+        const site_stats &cur;
+        const char *metric;
+        bool expect;
+    };
+    const check checks[] = {
+        {"unchanged", same, "mean", false},
+        {"unchanged", same, "p50", false},
+        {"unchanged", same, "p99", false},
+        {"tail regression", tail, "mean", false},
+        {"tail regression", tail, "p99", true},
+        {"shift", shift, "mean", true},
+        {"shift", shift, "p50", true},
+        {"shift", shift, "p99", true},
+    };
+    int failed = 0;
+    for (auto &c : checks)
+    {
+        gate_options opt;
+        opt.metric = c.metric;
+        double p;
+        bool r = regressed(base, c.cur, opt, p);
+        printf("%-16s %-4s: %s = %.3f -> %.3f, p-value = %.4f, %s%s\n", c.name, c.metric, c.metric, metric_of(base, c.metric),
+               metric_of(c.cur, c.metric), p, r ? "regressed" : "not regressed", r == c.expect ? "" : "  FAILED");
+        failed += r != c.expect;
+    }
+    printf("%s\n", failed ? "self test failed" : "self test passed");
+    return failed ? 1 : 0;
+}
+
+static int usage(const char *prog)
+{
+    printf("Usage: %s [--metric mean|p50|p99] [--threshold PCT] [--alpha P] [--min-count N] <base_trace> <new_trace>\n", prog);
+    printf("       %s --self-test\n", prog);
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    gate_options opt;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--self-test")
+            return self_test();
+        if (arg == "--metric" && has_value)
+            opt.metric = argv[++i];
+        else if (arg == "--threshold" && has_value)
+            opt.threshold = std::atof(argv[++i]);
+        else if (arg == "--alpha" && has_value)
+            opt.alpha = std::atof(argv[++i]);
+        else if (arg == "--min-count" && has_value)
+            opt.min_count = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg.compare(0, 2, "--") == 0)
+            return usage(argv[0]);
+        else
+            files.push_back(argv[i]);
+    }
+    if (files.size() != 2 || (opt.metric != "mean" && opt.metric != "p50" && opt.metric != "p99"))
+        return usage(argv[0]);
+
+    std::map<std::string, site_stats> base, cur;
+    if (!load_trace(files[0], base) || !load_trace(files[1], cur))
+        return 2;
+
+    printf("%-40s %10s %10s %12s %12s %8s %12s %12s %8s %12s %12s %8s %9s\n", "site", "count", "count'", "mean[us]", "mean'[us]", "delta",
+           "p50[us]", "p50'[us]", "delta", "p99[us]", "p99'[us]", "delta", "p-value");
+    int regressions = 0;
+    for (auto &b : base)
+    {
+        auto it = cur.find(b.first);
+        if (it == cur.end())
+        {
+            printf("%-40s %10llu %10s  (removed)\n", b.first.c_str(), static_cast<unsigned long long>(b.second.count), "-");
+            continue;
+        }
+        const site_stats &s0 = b.second;
+        const site_stats &s1 = it->second;
+        double p50[2] = {s0.hist.quantile(0.5), s1.hist.quantile(0.5)};
+        double p99[2] = {s0.hist.quantile(0.99), s1.hist.quantile(0.99)};
+        double p;
+        bool is_regressed = regressed(s0, s1, opt, p);
+        if (is_regressed)
+            regressions++;
+        printf("%-40s %10llu %10llu %12.3f %12.3f %7.1f%% %12.3f %12.3f %7.1f%% %12.3f %12.3f %7.1f%% %9.4f%s\n", b.first.c_str(),
+               static_cast<unsigned long long>(s0.count), static_cast<unsigned long long>(s1.count), s0.mean, s1.mean, delta_pct(s0.mean, s1.mean),
+               p50[0], p50[1], delta_pct(p50[0], p50[1]), p99[0], p99[1], delta_pct(p99[0], p99[1]), p, is_regressed ? "  REGRESSION" : "");
+    }
+    for (auto &c : cur)
+    {
+        if (base.find(c.first) == base.end())
+            printf("%-40s %10s %10llu  (added)\n", c.first.c_str(), "-", static_cast<unsigned long long>(c.second.count));
+    }
+
+    printf("%d of %zu sites regressed (%s > %.1f%%, p < %.3f)\n", regressions, base.size(), opt.metric.c_str(), opt.threshold, opt.alpha);
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sycl/sycl.hpp>
+
+//
+// Size class USM pool: freed blocks are kept in per size class free lists and handed out again
+// instead of going back to the driver. Size classes are powers of two starting at 4 KB, blocks
+// above max_cached_size are not cached, and a pool keeps at most max_cached_bytes in its free lists.
+// If the driver runs out of memory, the cached blocks of all pools are released before one retry.
+//
+// One pool serves one (context, device, kind): host allocations ignore the device, but device and
+// shared allocations are bound to it.
+//
+// auto &pool = usm_pool(q, sycl::usm::alloc::host);
+// char *p = pool.allocate<char>(size);
+// ...
+// pool.deallocate(p);
+//
+inline void usm_pool_release_cached();
+
+class UsmPool
+{
+public:
+    static constexpr size_t min_class_size = 4096;
+    static constexpr size_t max_cached_size = static_cast<size_t>(1) << 30;
+    static constexpr size_t default_max_cached_bytes = static_cast<size_t>(2) << 30;
+
+    UsmPool(const sycl::context &ctx, const sycl::device &dev, sycl::usm::alloc kind, size_t max_cached_bytes = default_max_cached_bytes)
+        : _ctx(ctx), _dev(dev), _kind(kind), _max_cached_bytes(max_cached_bytes) {}
+    UsmPool(UsmPool &other) = delete;
+    void operator=(const UsmPool &) = delete;
+    ~UsmPool()
+    {
+        release();
+    }
+
+    void *allocate(size_t bytes)
+    {
+        size_t size = class_size(bytes);
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            auto &free_list = _free[size];
+            if (!free_list.empty())
+            {
+                void *ptr = free_list.back();
+                free_list.pop_back();
+                _cached_bytes -= size;
+                _live[ptr] = size;
+                _hits++;
+                return ptr;
+            }
+            _misses++;
+        }
+        void *ptr = sycl::malloc(size, _dev, _ctx, _kind);
+        if (ptr == nullptr)
+        {
+            // Out of memory: give the cached blocks of every pool back to the driver and retry once
+            usm_pool_release_cached();
+            release();
+            ptr = sycl::malloc(size, _dev, _ctx, _kind);
+            if (ptr == nullptr)
+                return nullptr;
+        }
+        std::lock_guard<std::mutex> lk(_mutex);
+        _live[ptr] = size;
+        return ptr;
+    }
+
+    template <typename T>
+    T *allocate(size_t count)
+    {
+        return static_cast<T *>(allocate(count * sizeof(T)));
+    }
+
+    void deallocate(void *ptr)
+    {
+        if (ptr == nullptr)
+            return;
+        std::lock_guard<std::mutex> lk(_mutex);
+        auto it = _live.find(ptr);
+        if (it == _live.end())
+        {
+            printf("UsmPool: deallocate of unknown pointer %p\n", ptr);
+            return;
+        }
+        size_t size = it->second;
+        _live.erase(it);
+        if (size > max_cached_size || _cached_bytes + size > _max_cached_bytes)
+        {
+            sycl::free(ptr, _ctx);
+        }
+        else
+        {
+            _free[size].push_back(ptr);
+            _cached_bytes += size;
+        }
+    }
+
+    // Free all cached blocks, blocks which are still in use stay valid.
+    void release()
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        for (auto &free_list : _free)
+        {
+            for (auto ptr : free_list.second)
+                sycl::free(ptr, _ctx);
+        }
+        _free.clear();
+        _cached_bytes = 0;
+    }
+
+    uint64_t hits() const { return _hits; }
+    uint64_t misses() const { return _misses; }
+    size_t cached_bytes()
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        return _cached_bytes;
+    }
+    const sycl::context &context() const { return _ctx; }
+    const sycl::device &device() const { return _dev; }
+    sycl::usm::alloc kind() const { return _kind; }
+
+    static size_t class_size(size_t bytes)
+    {
+        if (bytes > max_cached_size)
+            return bytes;
+        size_t size = min_class_size;
+        while (size < bytes)
+            size <<= 1;
+        return size;
+    }
+
+private:
+    sycl::context _ctx;
+    sycl::device _dev;
+    sycl::usm::alloc _kind;
+    size_t _max_cached_bytes;
+    size_t _cached_bytes = 0; // Bytes in _free, guarded by _mutex
+    std::mutex _mutex;
+    std::map<size_t, std::vector<void *>> _free;
+    std::unordered_map<void *, size_t> _live;
+    // Atomic, read without _mutex by hits()/misses()
+    std::atomic<uint64_t> _hits{0};
+    std::atomic<uint64_t> _misses{0};
+};
+
+inline std::vector<std::unique_ptr<UsmPool>> &usm_pools()
+{
+    static std::vector<std::unique_ptr<UsmPool>> pools;
+    return pools;
+}
+
+inline std::mutex &usm_pools_mutex()
+{
+    static std::mutex m;
+    return m;
+}
+
+// The pool of queue q's context and device for `kind`, created on first use.
+inline UsmPool &usm_pool(const sycl::queue &q, sycl::usm::alloc kind)
+{
+    std::lock_guard<std::mutex> lk(usm_pools_mutex());
+    auto ctx = q.get_context();
+    auto dev = q.get_device();
+    for (auto &pool : usm_pools())
+    {
+        if (pool->kind() == kind && pool->context() == ctx && (kind == sycl::usm::alloc::host || pool->device() == dev))
+            return *pool;
+    }
+    usm_pools().emplace_back(new UsmPool(ctx, dev, kind));
+    return *usm_pools().back();
+}
+
+// Give the cached blocks of all pools back to the driver, blocks in use stay valid.
+inline void usm_pool_release_cached()
+{
+    std::lock_guard<std::mutex> lk(usm_pools_mutex());
+    for (auto &pool : usm_pools())
+        pool->release();
+}
+
+// Release all pools, call it before the end of main() so no USM is freed after the SYCL runtime is gone.
+inline void usm_pool_release_all()
+{
+    std::lock_guard<std::mutex> lk(usm_pools_mutex());
+    usm_pools().clear();
+}